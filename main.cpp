@@ -8,6 +8,9 @@
 #include <sstream>
 #include <string>
 #include <format>
+#include <fstream>
+#include <chrono>
+#include <optional>
 
 #include <amqpcpp.h>
 #include <amqpcpp/libboostasio.h>
@@ -53,7 +56,8 @@ auto overloaded(F... f) {
 class TelegramClient {
 public:
     TelegramClient(const std::int32_t api_id, const std::string &api_hash, const std::string &channels_string,
-                   const std::string &base_url, const std::string &rabbit_queue, AMQP::TcpChannel *rabbit_channel) {
+                   const std::string &base_url, const std::string &rabbit_queue, AMQP::TcpChannel *rabbit_channel,
+                   const bool preview_first) {
         td::ClientManager::execute(td::td_api::make_object<td::td_api::setLogVerbosityLevel>(1));
         client_manager_ = std::make_unique<td::ClientManager>();
         client_id_ = client_manager_->create_client_id();
@@ -63,6 +67,7 @@ public:
         base_url_ = base_url;
         rabbit_channel_ = rabbit_channel;
         rabbit_queue_ = rabbit_queue;
+        preview_first_ = preview_first;
 
         std::vector<std::string> channels;
         split(channels, channels_string, boost::is_any_of(", "), boost::token_compress_on);
@@ -140,6 +145,7 @@ public:
 
                     boost::json::object rabbit_message;
 
+                    rabbit_message["repost_id"] = std::format("{}_{}", message->chat_id_, message->id_);
                     rabbit_message["chat_name"] = chat_title_[message->chat_id_];
                     rabbit_message["chat_icon"] =
                             "https://seeklogo.com/images/T/telegram-logo-2A32756393-seeklogo.com.png";
@@ -157,7 +163,10 @@ public:
                                           );
 
                                           auto animation_url = std::format("{}/{}", base_url_, animation_path);
-                                          rabbit_message["files"] = {animation_url};
+                                          bool preview = set_files(rabbit_message,
+                                                                   animation_message.animation_->minithumbnail_.get(),
+                                                                   *animation_message.animation_->animation_,
+                                                                   animation_url);
 
                                           auto download_request = td::td_api::make_object<td::td_api::downloadFile>();
                                           download_request->file_id_ = animation_message.animation_->animation_->id_;
@@ -167,14 +176,8 @@ public:
                                           download_request->synchronous_ = true;
 
                                           send_query(std::move(download_request),
-                                                     [this, animation_path](Object object) {
-                                                         if (object->get_id() == td::td_api::error::ID) {
-                                                             return;
-                                                         }
-                                                         auto file = td::move_tl_object_as<td::td_api::file>(object);
-
-                                                         std::filesystem::rename(file->local_->path_, animation_path);
-                                                     });
+                                                     media_download_handler(rabbit_message, animation_path,
+                                                                            animation_url, preview));
                                       },
                                       [this, &rabbit_message](td::td_api::messageSticker &sticker_message) {
                                           if (sticker_message.sticker_->format_->get_id() ==
@@ -233,7 +236,9 @@ public:
                                               photo->remote_->unique_id_
                                           );
                                           std::string photo_url = std::format("{}/{}", base_url_, photo_path);
-                                          rabbit_message["files"] = {photo_url};
+                                          bool preview = set_files(rabbit_message,
+                                                                   photo_message.photo_->minithumbnail_.get(), *photo,
+                                                                   photo_url);
 
                                           auto download_request = td::td_api::make_object<td::td_api::downloadFile>();
                                           download_request->file_id_ = photo->id_;
@@ -243,14 +248,8 @@ public:
                                           download_request->synchronous_ = true;
 
                                           send_query(std::move(download_request),
-                                                     [this, photo_path](Object object) {
-                                                         if (object->get_id() == td::td_api::error::ID) {
-                                                             return;
-                                                         }
-                                                         auto file = td::move_tl_object_as<td::td_api::file>(object);
-
-                                                         std::filesystem::rename(file->local_->path_, photo_path);
-                                                     });
+                                                     media_download_handler(rabbit_message, photo_path, photo_url,
+                                                                            preview));
                                       },
                                       [this, &rabbit_message](td::td_api::messageVideo &video_message) {
                                           rabbit_message["text"] = video_message.caption_->text_;
@@ -264,7 +263,9 @@ public:
                                           );
 
                                           auto video_url = std::format("{}/{}", base_url_, video_path);
-                                          rabbit_message["files"] = {video_url};
+                                          bool preview = set_files(rabbit_message,
+                                                                   video_message.video_->minithumbnail_.get(),
+                                                                   *video_message.video_->video_, video_url);
 
                                           auto download_request = td::td_api::make_object<td::td_api::downloadFile>();
                                           download_request->file_id_ = video_message.video_->video_->id_;
@@ -274,14 +275,8 @@ public:
                                           download_request->synchronous_ = true;
 
                                           send_query(std::move(download_request),
-                                                     [this, video_path](Object object) {
-                                                         if (object->get_id() == td::td_api::error::ID) {
-                                                             return;
-                                                         }
-                                                         auto file = td::move_tl_object_as<td::td_api::file>(object);
-
-                                                         std::filesystem::rename(file->local_->path_, video_path);
-                                                     });
+                                                     media_download_handler(rabbit_message, video_path, video_url,
+                                                                            preview));
                                       },
                                       [this, &rabbit_message](td::td_api::messageVideoNote &video_note_message) {
                                           std::string video_path = std::format(
@@ -347,6 +342,7 @@ private:
     std::int32_t api_id_;
     std::string api_hash_;
     std::string base_url_;
+    bool preview_first_{false};
 
     std::vector<int64_t> chat_ids_;
     std::map<std::int64_t, std::string> chat_title_{};
@@ -364,6 +360,94 @@ private:
         client_manager_->send(client_id_, query_id, std::move(f));
     }
 
+    // Previews are kept until they are surely fetched by the reposter, and removed once they are this old.
+    static constexpr auto preview_ttl = std::chrono::hours(24);
+
+    static std::string preview_path(const std::string &repost_id) {
+        return std::format("tdlib/static/{}_preview.jpg", repost_id);
+    }
+
+    static void remove_stale_previews() {
+        std::error_code error;
+        auto now = std::filesystem::file_time_type::clock::now();
+        for (auto &entry : std::filesystem::directory_iterator("tdlib/static", error)) {
+            if (!entry.path().filename().string().ends_with("_preview.jpg")) {
+                continue;
+            }
+            auto last_write = entry.last_write_time(error);
+            if (!error && now - last_write > preview_ttl) {
+                std::filesystem::remove(entry.path(), error);
+            }
+        }
+    }
+
+    // Minithumbnail is an inline JPEG shipped with the message itself, so it can be served without any download.
+    std::optional<std::string> write_minithumbnail(const std::string &repost_id,
+                                                   const td::td_api::minithumbnail &minithumbnail) {
+        remove_stale_previews();
+
+        std::string path = preview_path(repost_id);
+        std::ofstream preview(path, std::ios::binary);
+        preview << minithumbnail.data_;
+        preview.close();
+        if (!preview) {
+            std::error_code error;
+            std::filesystem::remove(path, error);
+            return std::nullopt;
+        }
+        return std::format("{}/{}", base_url_, path);
+    }
+
+    // Sets repost files to minithumbnail if preview-first is enabled and the full file is not in TDLib cache already,
+    // otherwise to full file. Returns whether the repost was published as a preview and awaits an upgrade.
+    bool set_files(boost::json::object &rabbit_message, const td::td_api::minithumbnail *minithumbnail,
+                   const td::td_api::file &file, const std::string &file_url) {
+        if (preview_first_ && minithumbnail != nullptr && !file.local_->is_downloading_completed_) {
+            auto preview_url = write_minithumbnail(rabbit_message["repost_id"].as_string().c_str(), *minithumbnail);
+            if (preview_url) {
+                rabbit_message["preview"] = true;
+                rabbit_message["files"] = {*preview_url};
+                return true;
+            }
+        }
+        rabbit_message["files"] = {file_url};
+        return false;
+    }
+
+    std::function<void(Object)> media_download_handler(const boost::json::object &rabbit_message,
+                                                       const std::string &file_path, const std::string &file_url,
+                                                       const bool preview) {
+        return [this, rabbit_message, file_path, file_url, preview](Object object) {
+            if (object->get_id() == td::td_api::error::ID) {
+                if (preview) {
+                    publish_upgrade(rabbit_message, std::nullopt);
+                }
+                return;
+            }
+            auto file = td::move_tl_object_as<td::td_api::file>(object);
+
+            std::filesystem::rename(file->local_->path_, file_path);
+            if (preview) {
+                publish_upgrade(rabbit_message, file_url);
+            }
+        };
+    }
+
+    // Upgrade carries the whole repost, so the reposter can publish it anew if the preview message is unknown to it.
+    // Empty file_url means the full file could not be downloaded.
+    void publish_upgrade(boost::json::object upgrade_message, const std::optional<std::string> &file_url) {
+        upgrade_message.erase("preview");
+        upgrade_message["type"] = "upgrade";
+        if (file_url) {
+            upgrade_message["files"] = {*file_url};
+        } else {
+            upgrade_message["files"] = boost::json::array();
+            upgrade_message["failed"] = true;
+        }
+
+        rabbit_channel_->publish("", rabbit_queue_, serialize(upgrade_message));
+    }
+
     void authorize() {
         // ReSharper disable once CppDFAConstantConditions
         while (!authorized_) {
@@ -452,6 +536,8 @@ int main() {
         exit(1);
     }
 
+    auto preview_first = std::getenv("TD_PREVIEW_FIRST");
+
     boost::asio::io_service service(4);
     AMQP::LibBoostAsioHandler handler(service);
     AMQP::TcpConnection connection(&handler, AMQP::Address(rabbit_url));
@@ -467,6 +553,7 @@ int main() {
     });
     rabbit_thread.detach();
 
-    TelegramClient client(*api_id, api_hash, chats, base_url, rabbit_queue, &channel);
+    TelegramClient client(*api_id, api_hash, chats, base_url, rabbit_queue, &channel,
+                          preview_first != nullptr && std::string(preview_first) == "true");
     client.start();
 }
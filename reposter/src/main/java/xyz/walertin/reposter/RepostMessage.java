@@ -7,6 +7,11 @@ import java.util.List;
 
 @Data
 public class RepostMessage {
+    private String type;
+    @JsonProperty("repost_id")
+    private String repostId;
+    private boolean preview;
+    private boolean failed;
     @JsonProperty("chat_name")
     private String chatName;
     @JsonProperty("chat_icon")
@@ -1,7 +1,10 @@
 package xyz.walertin.reposter;
 
+import com.fasterxml.jackson.core.JsonProcessingException;
+import com.fasterxml.jackson.databind.JsonNode;
 import com.fasterxml.jackson.databind.ObjectMapper;
 import lombok.SneakyThrows;
+import lombok.extern.slf4j.Slf4j;
 import org.springframework.amqp.core.Message;
 import org.springframework.amqp.core.MessageListener;
 import org.springframework.beans.factory.annotation.Value;
@@ -9,55 +12,65 @@ import org.springframework.boot.configurationprocessor.json.JSONObject;
 import org.springframework.core.io.ByteArrayResource;
 import org.springframework.core.io.Resource;
 import org.springframework.http.*;
+import org.springframework.http.client.JdkClientHttpRequestFactory;
 import org.springframework.stereotype.Component;
 import org.springframework.util.LinkedMultiValueMap;
 import org.springframework.util.MultiValueMap;
+import org.springframework.web.client.HttpClientErrorException;
 import org.springframework.web.client.RestTemplate;
+import org.springframework.web.util.UriComponentsBuilder;
 
+import java.io.IOException;
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.time.Duration;
+import java.time.Instant;
+import java.util.ArrayList;
 import java.util.HashMap;
+import java.util.List;
 import java.util.Map;
 import java.util.Objects;
+import java.util.stream.Stream;
 
+@Slf4j
 @Component
 public class TGMessageListener implements MessageListener {
 
+    // well above the slowest full downloads, anything older is considered lost and is cleaned up
+    private static final Duration PREVIEW_TTL = Duration.ofDays(7);
+
     @Value("${reposter.webhook}")
     private String webhook;
 
+    // one file per repost_id, holding discord message id of the preview waiting for the full file;
+    // kept on disk so upgrades arriving after restart still edit the preview instead of posting a duplicate
+    @Value("${reposter.previews:previews}")
+    private String previewsDir;
+
     @SneakyThrows
     @Override
     public void onMessage(Message message) {
         ObjectMapper mapper = new ObjectMapper();
         RepostMessage repost = mapper.readValue(message.getBody(), RepostMessage.class);
 
+        if ("upgrade".equals(repost.getType())) {
+            upgrade(repost);
+        } else if (repost.isPreview()) {
+            postPreview(repost, mapper);
+        } else {
+            post(repost);
+        }
+    }
+
+    @SneakyThrows
+    private void post(RepostMessage repost) {
         if (repost.getFiles() != null && !repost.getFiles().isEmpty()) {
             RestTemplate restTemplate = new RestTemplate();
             HttpHeaders headers = new HttpHeaders();
             headers.setContentType(MediaType.MULTIPART_FORM_DATA);
 
 
-            MultiValueMap<String, Object> body = new LinkedMultiValueMap<>();
-            Map<String, String> payload = new HashMap<>();
-            payload.put("content", repost.getText().isBlank() ? "[Original message unavailable]" : repost.getText());
-            payload.put("username", repost.getChatName());
-            payload.put("avatar_url", repost.getChatIcon());
-            body.add("payload_json", payload);
-
-
-            int fileIndex = 1;
-            for (String fileUrl : repost.getFiles()) {
-                ResponseEntity<Resource> exchange = restTemplate.exchange(fileUrl, HttpMethod.GET, null, Resource.class);
-                if (!exchange.getStatusCode().is2xxSuccessful()) {
-                    continue;
-                }
-
-                body.add(String.format("file%d", fileIndex++), new ByteArrayResource(Objects.requireNonNull(exchange.getBody()).getContentAsByteArray()){
-                    @Override
-                    public String getFilename() {
-                        return fileUrl.split("/")[fileUrl.split("/").length - 1];
-                    }
-                });
-            }
+            MultiValueMap<String, Object> body = repostBody(restTemplate, repost);
 
             HttpEntity<MultiValueMap<String, ?>> requestEntity = new HttpEntity<>(body, headers);
             try {
@@ -86,5 +99,209 @@ public class TGMessageListener implements MessageListener {
 
             HttpEntity<String> request = new HttpEntity<>(payload.toString(), headers);
             restTemplate.postForEntity(webhook, request, String.class);
+        }
+    }
+
+    @SneakyThrows
+    private void postPreview(RepostMessage repost, ObjectMapper mapper) {
+        RestTemplate restTemplate = new RestTemplate();
+        HttpHeaders headers = new HttpHeaders();
+        headers.setContentType(MediaType.MULTIPART_FORM_DATA);
+
+        MultiValueMap<String, Object> body = repostBody(restTemplate, repost);
+
+        // wait=true makes discord return created message, its id is needed to edit it later
+        String webhookWait = UriComponentsBuilder.fromUriString(webhook)
+                .queryParam("wait", true)
+                .toUriString();
+        HttpEntity<MultiValueMap<String, ?>> requestEntity = new HttpEntity<>(body, headers);
+        ResponseEntity<String> response;
+        try {
+            response = restTemplate.postForEntity(webhookWait, requestEntity, String.class);
+        } catch (HttpClientErrorException e) {
+            if (e instanceof HttpClientErrorException.TooManyRequests) {
+                throw e;
+            }
+            // upgrade of unknown repost is posted as a new message, so nothing is lost
+            log.error("Failed to post preview of repost {}", repost.getRepostId(), e);
+            return;
+        }
+
+        JsonNode id;
+        try {
+            id = mapper.readTree(response.getBody()).get("id");
+        } catch (JsonProcessingException e) {
+            id = null;
+        }
+        if (id == null) {
+            log.warn("Discord returned no message id for preview of repost {}, it won't be upgraded", repost.getRepostId());
+            return;
+        }
+
+        removeStalePreviews();
+        Files.createDirectories(Path.of(previewsDir));
+        Files.writeString(Path.of(previewsDir, repost.getRepostId()), id.asText());
+    }
+
+    @SneakyThrows
+    private void upgrade(RepostMessage repost) {
+        Path preview = Path.of(previewsDir, repost.getRepostId());
+        if (!Files.exists(preview)) {
+            log.warn("No preview message for repost {}, posting it as a new message", repost.getRepostId());
+            if (repost.isFailed()) {
+                postText(repost, "[Original entity unavailable]");
+            } else {
+                post(repost);
+            }
+            return;
+        }
+
+        // transient failures propagate, so the upgrade is requeued and the preview id is kept for the retry
+        editPreview(repost, Files.readString(preview).trim());
+        Files.deleteIfExists(preview);
+    }
+
+    private void editPreview(RepostMessage repost, String messageId) {
+        // default HttpURLConnection based factory can't do PATCH
+        RestTemplate restTemplate = new RestTemplate(new JdkClientHttpRequestFactory());
+        String editUrl = UriComponentsBuilder.fromUriString(webhook)
+                .path("/messages/{id}")
+                .buildAndExpand(messageId)
+                .toUriString();
+
+        if (repost.isFailed() || repost.getFiles() == null || repost.getFiles().isEmpty()) {
+            editContent(restTemplate, editUrl, repost, "[Original entity unavailable]");
+            return;
+        }
+
+        HttpHeaders headers = new HttpHeaders();
+        headers.setContentType(MediaType.MULTIPART_FORM_DATA);
+
+        MultiValueMap<String, Object> body = new LinkedMultiValueMap<>();
+        List<Map<String, Integer>> attachments = attachFiles(body, restTemplate, repost.getFiles());
+        if (attachments.isEmpty()) {
+            editContent(restTemplate, editUrl, repost, "[Original entity unavailable]");
+            return;
+        }
+        // attachments not listed here are dropped, which removes the preview
+        body.add("payload_json", Map.of("attachments", attachments));
+
+        HttpEntity<MultiValueMap<String, ?>> requestEntity = new HttpEntity<>(body, headers);
+        try {
+            restTemplate.exchange(editUrl, HttpMethod.PATCH, requestEntity, String.class);
+        } catch (HttpClientErrorException e) {
+            if (e instanceof HttpClientErrorException.TooManyRequests) {
+                throw e;
+            }
+            if (e.getStatusCode().isSameCodeAs(HttpStatus.PAYLOAD_TOO_LARGE)) {
+                editContent(restTemplate, editUrl, repost, "[Original entity too large]");
+                return;
+            }
+            log.error("Failed to upgrade preview of repost {}", repost.getRepostId(), e);
+            editContent(restTemplate, editUrl, repost, "[Original entity unavailable]");
+        }
+    }
+
+    // Leaves the preview attachment as is, only tells readers that the full file won't come
+    @SneakyThrows
+    private void editContent(RestTemplate restTemplate, String editUrl, RepostMessage repost, String notice) {
+        HttpHeaders headers = new HttpHeaders();
+        headers.setContentType(MediaType.APPLICATION_JSON);
+
+        JSONObject payload = new JSONObject();
+        payload.put("content", withNotice(repost, notice));
+
+        HttpEntity<String> request = new HttpEntity<>(payload.toString(), headers);
+        try {
+            restTemplate.exchange(editUrl, HttpMethod.PATCH, request, String.class);
+        } catch (HttpClientErrorException e) {
+            if (e instanceof HttpClientErrorException.TooManyRequests) {
+                throw e;
+            }
+            log.error("Failed to mark preview of repost {} as {}", repost.getRepostId(), notice, e);
+        }
+    }
+
+    @SneakyThrows
+    private void postText(RepostMessage repost, String notice) {
+        RestTemplate restTemplate = new RestTemplate();
+        HttpHeaders headers = new HttpHeaders();
+        headers.setContentType(MediaType.APPLICATION_JSON);
+
+        JSONObject payload = new JSONObject();
+        payload.put("content", withNotice(repost, notice));
+        payload.put("username", repost.getChatName());
+        payload.put("avatar_url", repost.getChatIcon());
+
+        HttpEntity<String> request = new HttpEntity<>(payload.toString(), headers);
+        restTemplate.postForEntity(webhook, request, String.class);
+    }
+
+    private static String withNotice(RepostMessage repost, String notice) {
+        return repost.getText().isBlank() ? notice : repost.getText() + "\n" + notice;
+    }
+
+    private void removeStalePreviews() throws IOException {
+        Path dir = Path.of(previewsDir);
+        if (!Files.isDirectory(dir)) {
+            return;
+        }
+
+        Instant expired = Instant.now().minus(PREVIEW_TTL);
+        try (Stream<Path> previews = Files.list(dir)) {
+            for (Path preview : previews.toList()) {
+                if (Files.getLastModifiedTime(preview).toInstant().isBefore(expired)) {
+                    Files.deleteIfExists(preview);
+                }
+            }
+        }
+    }
+
+    private MultiValueMap<String, Object> repostBody(RestTemplate restTemplate, RepostMessage repost) {
+        MultiValueMap<String, Object> body = new LinkedMultiValueMap<>();
+        Map<String, String> payload = new HashMap<>();
+        payload.put("content", repost.getText().isBlank() ? "[Original message unavailable]" : repost.getText());
+        payload.put("username", repost.getChatName());
+        payload.put("avatar_url", repost.getChatIcon());
+        body.add("payload_json", payload);
+
+        attachFiles(body, restTemplate, repost.getFiles());
+        return body;
+    }
+
+    // Adds files as files[n] parts, returns their attachment entries for payload_json
+    private List<Map<String, Integer>> attachFiles(MultiValueMap<String, Object> body, RestTemplate restTemplate,
+                                                   List<String> fileUrls) {
+        List<Map<String, Integer>> attachments = new ArrayList<>();
+        for (ByteArrayResource file : downloadFiles(restTemplate, fileUrls)) {
+            int fileIndex = attachments.size();
+            attachments.add(Map.of("id", fileIndex));
+            body.add(String.format("files[%d]", fileIndex), file);
+        }
+        return attachments;
+    }
+
+    // Not yet downloaded file makes GET fail, the exception is passed on so the listener requeues the message
+    @SneakyThrows
+    private List<ByteArrayResource> downloadFiles(RestTemplate restTemplate, List<String> fileUrls) {
+        List<ByteArrayResource> files = new ArrayList<>();
+        if (fileUrls == null) {
+            return files;
+        }
+
+        for (String fileUrl : fileUrls) {
+            ResponseEntity<Resource> exchange = restTemplate.exchange(fileUrl, HttpMethod.GET, null, Resource.class);
+            if (!exchange.getStatusCode().is2xxSuccessful()) {
+                continue;
+            }
+
+            files.add(new ByteArrayResource(Objects.requireNonNull(exchange.getBody()).getContentAsByteArray()){
+                @Override
+                public String getFilename() {
+                    return fileUrl.split("/")[fileUrl.split("/").length - 1];
+                }
+            });
+        }
+        return files;
     }
-}}
+}